@@ -19,12 +19,82 @@
  */
 
 #include "KiwiScheduler.hpp"
+#include <algorithm>
+#include <cassert>
+#ifdef KIWI_SCHEDULER_SHARED_QUEUE
+#include "KiwiSharedQueue.hpp"
+#endif
 
 namespace kiwi
 {
     namespace engine
     {
         
+        // ================================================================================ //
+        //                                      GRAPH                                       //
+        // ================================================================================ //
+        
+        void Scheduler::Graph::add(Node& node)
+        {
+            assert((!node.m_graph || node.m_graph == this) && "the node belongs to another graph");
+            if(!node.m_graph)
+            {
+                node.m_graph = this;
+                node.m_graph_next = m_nodes;
+                m_nodes = &node;
+            }
+        }
+        
+        void Scheduler::Graph::link(Node& from, Node& to)
+        {
+            assert((!from.m_graph || from.m_graph == this) && "the node belongs to another graph");
+            assert((!to.m_graph || to.m_graph == this) && "the node belongs to another graph");
+            add(from);
+            add(to);
+            from.m_successors.push_back(&to);
+            ++to.m_predecessors;
+        }
+        
+        void Scheduler::Graph::dropped()
+        {
+            for(Node* node = m_nodes; node; node = node->m_graph_next)
+            {
+                node->m_timer.dropped();
+            }
+        }
+        
+        void Scheduler::Graph::callback()
+        {
+            // Resets the counters and collects the nodes without predecessor
+            Node* ready = nullptr;
+            for(Node* node = m_nodes; node; node = node->m_graph_next)
+            {
+                node->m_remaining.store(node->m_predecessors, std::memory_order_relaxed);
+                if(!node->m_predecessors)
+                {
+                    node->m_ready_next = ready;
+                    ready = node;
+                }
+            }
+            
+            // Calls the ready nodes, a successor is ready when its last predecessor has
+            // been called
+            while(ready)
+            {
+                Node* node = ready;
+                ready = node->m_ready_next;
+                node->m_timer.callback();
+                for(Node* next : node->m_successors)
+                {
+                    if(next->m_remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    {
+                        next->m_ready_next = ready;
+                        ready = next;
+                    }
+                }
+            }
+        }
+        
         // ================================================================================ //
         //                                  SCHEDULER QUEUE                                 //
         // ================================================================================ //
@@ -33,6 +103,8 @@ namespace kiwi
         {
             // The list of tasks to perform before the given time
             Task *ready = nullptr;
+            // The list of tasks dropped by the policy
+            Task *dropped = nullptr;
             
             // ------------------------------------------//
             // Retrieves the tasks before the given time //
@@ -49,6 +121,7 @@ namespace kiwi
                 while(head && head->m_time <= time)
                 {
                     tail = head;
+                    head->m_pending = false;
                     head->m_process_next = head->m_next;
                     head = head->m_process_next;
                 }
@@ -61,6 +134,7 @@ namespace kiwi
                     tail->m_process_next = nullptr;
                     ready        = m_main;
                     m_main       = head;
+                    ready        = shed(ready, dropped, time);
                 }
             }
             
@@ -83,7 +157,7 @@ namespace kiwi
                     m_futur_mutex.unlock();
                     if(operation == Task::futur_type_t::to_add)
                     {
-                        add(*current, current->m_futur_time);
+                        add(*current, current->m_futur_time, current->m_futur_min, current->m_futur_max);
                     }
                     else if(operation == Task::futur_type_t::to_remove)
                     {
@@ -99,6 +173,13 @@ namespace kiwi
             // Performs the tasks                        //
             // ------------------------------------------//
             // As we don't touch the task, we can call it without locks
+            while(dropped)
+            {
+                Task* next = dropped->m_process_next;
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                dropped->m_timer.dropped();
+                dropped = next;
+            }
             while(ready)
             {
                 ready->m_timer.callback();
@@ -106,118 +187,249 @@ namespace kiwi
             }
         }
         
-        void Scheduler::Queue::add(Task& task, time_point_t const time)
+        namespace
+        {
+            // The passes of all the queues, so a tag is never marked by another pass
+            std::atomic<size_t> coalesce_epoch {0};
+        }
+        
+        Scheduler::Task* Scheduler::Queue::shed(Task* ready, Task*& dropped, time_point_t const time)
+        {
+            // ------------------------------------------//
+            // Drops the late tasks                      //
+            // ------------------------------------------//
+            if(m_policy.lateness != std::numeric_limits<time_point_t>::max())
+            {
+                Task** current = &ready;
+                while(*current)
+                {
+                    Task* task = *current;
+                    if(time - task->m_time > m_policy.lateness)
+                    {
+                        *current = task->m_process_next;
+                        task->m_process_next = dropped;
+                        dropped = task;
+                    }
+                    else
+                    {
+                        current = &task->m_process_next;
+                    }
+                }
+            }
+            
+            // ------------------------------------------//
+            // Coalesces the tasks of a same tag         //
+            // ------------------------------------------//
+            if(m_policy.coalesce)
+            {
+                // Reverses the list so the most recent tasks come first, then keeps a task
+                // only if its tag hasn't been marked during this pass. Pushing the kept tasks
+                // in front of the new list restores the time order.
+                size_t const epoch = ++coalesce_epoch;
+                Task* reversed = nullptr;
+                while(ready)
+                {
+                    Task* next = ready->m_process_next;
+                    ready->m_process_next = reversed;
+                    reversed = ready;
+                    ready = next;
+                }
+                while(reversed)
+                {
+                    Task* task = reversed;
+                    reversed = task->m_process_next;
+                    if(task->m_tag && task->m_tag->m_epoch == epoch)
+                    {
+                        task->m_process_next = dropped;
+                        dropped = task;
+                    }
+                    else
+                    {
+                        if(task->m_tag)
+                        {
+                            task->m_tag->m_epoch = epoch;
+                        }
+                        task->m_process_next = ready;
+                        ready = task;
+                    }
+                }
+            }
+            
+            // ------------------------------------------//
+            // Pushes back the tasks beyond the maximum  //
+            // ------------------------------------------//
+            if(m_policy.max_tasks != std::numeric_limits<size_t>::max())
+            {
+                Task *last = nullptr, *current = ready;
+                for(size_t i = 0; current && i < m_policy.max_tasks; ++i)
+                {
+                    last = current;
+                    current = current->m_process_next;
+                }
+                if(current)
+                {
+                    if(last)
+                    {
+                        last->m_process_next = nullptr;
+                    }
+                    else
+                    {
+                        ready = nullptr;
+                    }
+                    // The remaining tasks are sooner than the tasks of the main list, so
+                    // they're relinked in front of it.
+                    Task* tail = current;
+                    tail->m_pending = true;
+                    while(tail->m_process_next)
+                    {
+                        tail->m_next = tail->m_process_next;
+                        tail = tail->m_next;
+                        tail->m_pending = true;
+                    }
+                    tail->m_next = m_main;
+                    m_main = current;
+                }
+            }
+            return ready;
+        }
+        
+        namespace
+        {
+            inline Scheduler::time_point_t clip(Scheduler::time_point_t const time,
+                                                Scheduler::time_point_t const min,
+                                                Scheduler::time_point_t const max)
+            {
+                return time < min ? min : (time > max ? max : time);
+            }
+        }
+        
+        bool Scheduler::Queue::add(Task& task, time_point_t const time, time_point_t const min, time_point_t const max)
         {
             // If we're not performing on the main list
             if(m_main_mutex.try_lock())
             {
-                task.m_time = time;
                 task.m_futur_type = Task::futur_type_t::available;
-                if(m_main)
+                time_point_t next = time;
+                bool head = false;
+                if(task.m_pending)
                 {
-                    // First remove the task if the task is already in the main list
+                    // If the task doesn't move, there is nothing to do
+                    next = clip(task.m_time, min, max);
+                    if(next == task.m_time)
+                    {
+                        m_main_mutex.unlock();
+                        return false;
+                    }
+                    // Removes the task from the main list
                     if(m_main == &task)
                     {
                         m_main = task.m_next;
-                        task.m_next = nullptr;
+                        head = true;
                     }
-                    else
+                    else if(m_main)
                     {
                         Task *current = m_main->m_next, *previous = m_main;
-                        while(current)
+                        while(current && current != &task)
                         {
-                            if(current == &task)
-                            {
-                                previous->m_next = current->m_next;
-                                current->m_next = nullptr;
-                                break;
-                            }
                             previous = current;
                             current = current->m_next;
                         }
-                    }
-                    // Then add the task to the main list
-                    if(m_main)
-                    {
-                        if(m_main->m_time > task.m_time)
-                        {
-                            task.m_next = m_main;
-                            m_main   = &task;
-                            m_main_mutex.unlock();
-                            return;
-                        }
-                        Task *previous = m_main;
-                        Task *current = previous->m_next;
-                        while(current)
+                        if(current)
                         {
-                            if(current->m_time > task.m_time)
-                            {
-                                task.m_next = current;
-                                previous->m_next = &task;
-                                m_main_mutex.unlock();
-                                return;
-                            }
-                            previous = current;
-                            current = current->m_next;
+                            previous->m_next = current->m_next;
                         }
-                        previous->m_next = &task;
-                        task.m_next = nullptr;
-                    }
-                    else
-                    {
-                        m_main = &task;
-                        task.m_next = nullptr;
                     }
                 }
+                
+                // Then adds the task to the main list
+                task.m_time    = next;
+                task.m_pending = true;
+                if(!m_main || m_main->m_time > task.m_time)
+                {
+                    task.m_next = m_main;
+                    m_main   = &task;
+                }
                 else
                 {
-                    m_main = &task;
-                    task.m_next = nullptr;
+                    Task *previous = m_main;
+                    Task *current = previous->m_next;
+                    while(current && current->m_time <= task.m_time)
+                    {
+                        previous = current;
+                        current = current->m_next;
+                    }
+                    task.m_next = current;
+                    previous->m_next = &task;
                 }
+                head = head || m_main == &task;
                 m_main_mutex.unlock();
+                return head;
             }
             // Adds to task the futur list
             else
             {
+                // The operations are composed so the future operation is the same as the
+                // sequence of operations: if the task was pending at p, it will be at
+                // clip(clip(p, a, b), c, d) = clip(p, clip(a, c, d), clip(b, c, d)).
                 std::lock_guard<std::mutex> lock(m_futur_mutex);
-                if(task.m_futur_type == Task::futur_type_t::available)
+                if(task.m_futur_type == Task::futur_type_t::to_add)
                 {
-                    task.m_futur_next = m_futur;
-                    m_futur = &task;
+                    task.m_futur_time = clip(task.m_futur_time, min, max);
+                    task.m_futur_min  = clip(task.m_futur_min, min, max);
+                    task.m_futur_max  = clip(task.m_futur_max, min, max);
+                }
+                else
+                {
+                    // After a removal, the task isn't pending anymore
+                    if(task.m_futur_type == Task::futur_type_t::available)
+                    {
+                        task.m_futur_next = m_futur;
+                        m_futur = &task;
+                        task.m_futur_min  = min;
+                        task.m_futur_max  = max;
+                    }
+                    else
+                    {
+                        task.m_futur_min  = time;
+                        task.m_futur_max  = time;
+                    }
+                    task.m_futur_time = time;
                 }
-                task.m_futur_time = time;
                 task.m_futur_type = Task::futur_type_t::to_add;
+                return true;
             }
         }
         
-        void Scheduler::Queue::remove(Task& task)
+        bool Scheduler::Queue::remove(Task& task)
         {
             if(m_main_mutex.try_lock())
             {
                 task.m_futur_type = Task::futur_type_t::available;
-                if(m_main)
+                bool head = false;
+                if(task.m_pending)
                 {
+                    task.m_pending = false;
                     if(m_main == &task)
                     {
                         m_main = task.m_next;
+                        head = true;
                     }
-                    else
+                    else if(m_main)
                     {
                         Task *current = m_main->m_next, *previous = m_main;
-                        while(current)
+                        while(current && current != &task)
                         {
-                            if(current == &task)
-                            {
-                                previous->m_next = current->m_next;
-                                m_main_mutex.unlock();
-                                return;
-                            }
                             previous = current;
                             current = current->m_next;
                         }
+                        if(current)
+                        {
+                            previous->m_next = current->m_next;
+                        }
                     }
                 }
                 m_main_mutex.unlock();
+                return head;
             }
             else
             {
@@ -229,13 +441,64 @@ namespace kiwi
                 }
                 task.m_futur_time = 0;
                 task.m_futur_type = Task::futur_type_t::to_remove;
+                return true;
             }
         }
         
+        Scheduler::time_point_t Scheduler::Queue::next()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_futur_mutex);
+                if(m_futur)
+                {
+                    return 0;
+                }
+            }
+            std::lock_guard<std::mutex> lock(m_main_mutex);
+            return m_main ? m_main->m_time : std::numeric_limits<time_point_t>::max();
+        }
+        
+        void Scheduler::Queue::set_policy(Policy const& policy)
+        {
+            m_policy = policy;
+            m_policy.max_tasks = std::max(m_policy.max_tasks, size_t(1));
+        }
+        
+        size_t Scheduler::Queue::get_dropped() const
+        {
+            return m_dropped.load();
+        }
+        
         // ================================================================================ //
         //                                      SCHEDULER                                   //
         // ================================================================================ //
         
+        void Scheduler::Link::callback()
+        {
+            // The child may have been cleared during the perform of its parent
+            Scheduler* parent = m_owner.m_parent.load();
+            if(parent)
+            {
+                // The task is consumed, so the parent must update it
+                m_owner.perform(parent->m_time);
+                m_owner.notify();
+            }
+        }
+        
+        Scheduler::Scheduler() : m_link(*this)
+        {
+            
+        }
+        
+        Scheduler::~Scheduler()
+        {
+            while(m_first_child)
+            {
+                m_first_child->clear_parent();
+            }
+            clear_parent();
+        }
+        
         void Scheduler::prepare(id_t const queue_id)
         {
             m_queues[queue_id];
@@ -243,20 +506,249 @@ namespace kiwi
         
         void Scheduler::perform(time_point_t const time)
         {
+            m_time = time;
+            ++m_perform_count;
+            
+            // ------------------------------------------//
+            // Updates the tasks of the dirty children   //
+            // ------------------------------------------//
+            Scheduler* dirty = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(m_dirties_mutex);
+                dirty = m_dirties;
+                m_dirties = nullptr;
+            }
+            while(dirty)
+            {
+                // The child is cleaned before reading its time, so a change that occurs
+                // after will mark it again.
+                Scheduler* child = dirty;
+                dirty = child->m_dirty_next;
+                child->m_dirty_next = nullptr;
+                child->m_dirty.store(false);
+                if(child->m_parent.load() != this)
+                {
+                    continue;
+                }
+                ++child->m_update_count;
+                time_point_t const next = child->next();
+                if(next == std::numeric_limits<time_point_t>::max())
+                {
+                    m_children.remove(child->m_link.m_task);
+                }
+                else
+                {
+                    m_children.add(child->m_link.m_task, next);
+                }
+            }
+            
+            // ------------------------------------------//
+            // Performs the tasks                        //
+            // ------------------------------------------//
             for(auto& queue : m_queues)
             {
                 queue.second.perform(time);
             }
+#ifdef KIWI_SCHEDULER_SHARED_QUEUE
+            for(SharedQueue* queue = m_shared; queue; queue = queue->m_next)
+            {
+                queue->perform(time);
+            }
+#endif
+            m_children.perform(time);
         }
         
         void Scheduler::add(Task& task, time_point_t const time)
         {
-            m_queues[task.m_queue_id].add(task, time);
+            if(m_queues[task.m_queue_id].add(task, time))
+            {
+                notify();
+            }
+        }
+        
+        void Scheduler::add_if_earlier(Task& task, time_point_t const time)
+        {
+            if(m_queues[task.m_queue_id].add(task, time, 0, time))
+            {
+                notify();
+            }
+        }
+        
+        void Scheduler::add_if_later(Task& task, time_point_t const time)
+        {
+            if(m_queues[task.m_queue_id].add(task, time, time, std::numeric_limits<time_point_t>::max()))
+            {
+                notify();
+            }
+        }
+        
+        void Scheduler::add_if_not_pending(Task& task, time_point_t const time)
+        {
+            if(m_queues[task.m_queue_id].add(task, time, 0, std::numeric_limits<time_point_t>::max()))
+            {
+                notify();
+            }
+        }
+        
+        void Scheduler::add(Graph& graph, time_point_t const time)
+        {
+            add(graph.m_task, time);
         }
         
         void Scheduler::remove(Task& task)
         {
-            m_queues[task.m_queue_id].remove(task);
+            if(m_queues[task.m_queue_id].remove(task))
+            {
+                notify();
+            }
+        }
+        
+        void Scheduler::remove(Graph& graph)
+        {
+            remove(graph.m_task);
+        }
+        
+        void Scheduler::set_policy(id_t const queue_id, Policy const& policy)
+        {
+            m_queues[queue_id].set_policy(policy);
+        }
+        
+        size_t Scheduler::get_dropped(id_t const queue_id) const
+        {
+            auto it = m_queues.find(queue_id);
+            return it != m_queues.end() ? it->second.get_dropped() : 0;
+        }
+        
+#ifdef KIWI_SCHEDULER_SHARED_QUEUE
+        void Scheduler::attach(SharedQueue& queue)
+        {
+            detach(queue);
+            queue.m_next = m_shared;
+            m_shared = &queue;
+            notify();
+        }
+        
+        void Scheduler::detach(SharedQueue& queue)
+        {
+            SharedQueue** current = &m_shared;
+            while(*current)
+            {
+                if(*current == &queue)
+                {
+                    *current = queue.m_next;
+                    queue.m_next = nullptr;
+                    return;
+                }
+                current = &(*current)->m_next;
+            }
+        }
+#endif
+        
+        void Scheduler::set_parent(Scheduler& parent)
+        {
+            for(Scheduler* ancestor = &parent; ancestor; ancestor = ancestor->m_parent.load())
+            {
+                assert(ancestor != this && "the parent can't be the scheduler nor a child");
+            }
+            clear_parent();
+            m_next_sibling = parent.m_first_child;
+            parent.m_first_child = this;
+            m_parent.store(&parent);
+            notify();
+        }
+        
+        void Scheduler::clear_parent()
+        {
+            Scheduler* parent = m_parent.load();
+            if(parent)
+            {
+                // The parent is cleared inside the lock, so a producer that notifies in
+                // concurrence can't push the scheduler to the dirty list after this
+                {
+                    std::lock_guard<std::mutex> lock(parent->m_dirties_mutex);
+                    m_parent.store(nullptr);
+                    Scheduler** current = &parent->m_dirties;
+                    while(*current)
+                    {
+                        if(*current == this)
+                        {
+                            *current = m_dirty_next;
+                            break;
+                        }
+                        current = &(*current)->m_dirty_next;
+                    }
+                    m_dirty_next = nullptr;
+                    m_dirty.store(false);
+                }
+                Scheduler** child = &parent->m_first_child;
+                while(*child)
+                {
+                    if(*child == this)
+                    {
+                        *child = m_next_sibling;
+                        break;
+                    }
+                    child = &(*child)->m_next_sibling;
+                }
+                m_next_sibling = nullptr;
+                parent->m_children.remove(m_link.m_task);
+                parent->notify();
+            }
+        }
+        
+        void Scheduler::notify()
+        {
+            // Only the first change pushes the scheduler to the dirty list of its parent,
+            // then the parent itself is marked because its earliest time may change.
+            Scheduler* parent = m_parent.load();
+            if(parent && !m_dirty.exchange(true))
+            {
+                {
+                    std::lock_guard<std::mutex> lock(parent->m_dirties_mutex);
+                    if(m_parent.load() != parent)
+                    {
+                        m_dirty.store(false);
+                        return;
+                    }
+                    m_dirty_next = parent->m_dirties;
+                    parent->m_dirties = this;
+                }
+                parent->notify();
+            }
+        }
+        
+        size_t Scheduler::get_perform_count() const
+        {
+            return m_perform_count;
+        }
+        
+        size_t Scheduler::get_update_count() const
+        {
+            return m_update_count;
+        }
+        
+        Scheduler::time_point_t Scheduler::next()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_dirties_mutex);
+                if(m_dirties)
+                {
+                    return 0;
+                }
+            }
+#ifdef KIWI_SCHEDULER_SHARED_QUEUE
+            // The shared queues are not notified, so they're performed at each call
+            if(m_shared)
+            {
+                return 0;
+            }
+#endif
+            time_point_t time = m_children.next();
+            for(auto& queue : m_queues)
+            {
+                time = std::min(time, queue.second.next());
+            }
+            return time;
         }
     }
 }
@@ -21,9 +21,16 @@
 #ifndef KIWI_ENGINE_SCHEDULER_HPP_INCLUDED
 #define KIWI_ENGINE_SCHEDULER_HPP_INCLUDED
 
+#include <atomic>
 #include <chrono>
+#include <limits>
 #include <mutex>
 #include <map>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define KIWI_SCHEDULER_SHARED_QUEUE 1
+#endif
 
 namespace kiwi
 {
@@ -45,6 +52,10 @@ namespace kiwi
             using id_t              = uint32_t;
             using time_point_t      = size_t;
             
+#ifdef KIWI_SCHEDULER_SHARED_QUEUE
+            class SharedQueue;
+#endif
+            
             // ============================================================================ //
             //                                      TIMER                                   //
             // ============================================================================ //
@@ -57,6 +68,52 @@ namespace kiwi
                 
                 //! @brief The callback method
                 virtual void callback() = 0;
+                
+                //! @brief The method called when the task has been dropped by the policy.
+                virtual void dropped() {}
+            };
+            
+            // ============================================================================ //
+            //                                      POLICY                                  //
+            // ============================================================================ //
+            //! @brief The overload policy of a queue.
+            //! @details When the consumer falls behind, the policy defines which of the
+            //! overdue tasks are performed. The late tasks are dropped first, then the tasks
+            //! that share a tag with a more recent overdue task are dropped and at last, the
+            //! tasks beyond the maximum number of tasks are pushed back to the queue for the
+            //! next call. The dropped tasks aren't called but their timer is notified.
+            struct Policy
+            {
+                //! @brief The maximum delay of a task, the later tasks are dropped.
+                time_point_t    lateness  = std::numeric_limits<time_point_t>::max();
+                
+                //! @brief The maximum number of tasks performed per call.
+                //! @details The value is at least one, otherwise the tasks would never be
+                //! performed nor dropped.
+                size_t          max_tasks = std::numeric_limits<size_t>::max();
+                
+                //! @brief Only performs the most recent of the overdue tasks of a tag.
+                bool            coalesce  = false;
+            };
+            
+            // ============================================================================ //
+            //                                      TAG                                     //
+            // ============================================================================ //
+            //! @brief The tag shared by the tasks that can be coalesced by the policy.
+            //! @details The tag is marked by the queue when one of its tasks is kept, so the
+            //! queue coalesces the overdue tasks in a single pass.
+            class Tag
+            {
+            public:
+                //! @brief the constructor.
+                Tag() = default;
+                
+            private:
+                Tag(Tag const&) = delete;
+                Tag& operator=(Tag const&) = delete;
+                
+                size_t          m_epoch = 0;    //!< The last pass that kept a task.
+                friend class Scheduler;
             };
             
             // ============================================================================ //
@@ -71,9 +128,15 @@ namespace kiwi
                 //! @brief the constructor.
                 //! @param master The method to call.
                 //! @param queue_id The id of the queue in wich it will be added.
-                Task(Timer& master, const id_t queue_id = 0) : m_timer(master), m_queue_id(queue_id) {}
+                //! @param tag The tag used by the policy to coalesce the tasks, if any.
+                Task(Timer& master, const id_t queue_id = 0, Tag* tag = nullptr) :
+                m_timer(master), m_queue_id(queue_id), m_tag(tag) {}
                 
             private:
+                // A copy would share the links and the state of a pending task
+                Task(Task const&) = delete;
+                Task& operator=(Task const&) = delete;
+                
                 enum futur_type_t : unsigned
                 {
                     available = 0,
@@ -83,17 +146,98 @@ namespace kiwi
                 
                 Task*           m_next = nullptr;           //!< The next task in the queue.
                 time_point_t    m_time;                     //!< The current time of the task.
+                bool            m_pending = false;          //!< If the task is in the main list.
                 
                 Task*           m_process_next = nullptr;   //!< The next future task in the queue.
                 Timer&          m_timer;                    //!< The method to call.
                 
                 Task*           m_futur_next  = nullptr;    //!< The next future task in the queue.
                 time_point_t    m_futur_time;   //!< The future time if it waits for the insertion.
+                time_point_t    m_futur_min;    //!< The future minimum time if it's pending.
+                time_point_t    m_futur_max;    //!< The future maximum time if it's pending.
                 futur_type_t    m_futur_type = futur_type_t::available;   //!< The future action.
                 const id_t      m_queue_id;     //!< The id of the queue.
+                Tag* const      m_tag;          //!< The tag of the task.
+                friend class Scheduler;
+            };
+            
+            // ============================================================================ //
+            //                                      GRAPH                                   //
+            // ============================================================================ //
+            //! @brief A set of timers called in the order of their dependencies.
+            //! @details The graph is scheduled as a single task. When the task is performed,
+            //! the nodes without predecessor are called first, then each node is ready as
+            //! soon as its last predecessor has been called, without going through the
+            //! sorted list of a queue. The counters of the nodes are reset at each call, so
+            //! the graph can be scheduled again and again without any allocation. The links
+            //! must be created before the graph is scheduled and shouldn't create cycles.
+            class Graph : public Timer
+            {
+            public:
+                
+                // ======================================================================== //
+                //                                  NODE                                    //
+                // ======================================================================== //
+                //! @brief A node of a graph.
+                class Node
+                {
+                public:
+                    
+                    //! @brief the constructor.
+                    //! @param timer The method to call.
+                    Node(Timer& timer) : m_timer(timer) {}
+                    
+                private:
+                    Timer&              m_timer;                    //!< The method to call.
+                    Graph*              m_graph = nullptr;          //!< The owner of the node.
+                    Node*               m_graph_next = nullptr;     //!< The next node of the graph.
+                    Node*               m_ready_next = nullptr;     //!< The next ready node.
+                    std::vector<Node*>  m_successors;               //!< The successors.
+                    size_t              m_predecessors = 0;         //!< The number of predecessors.
+                    std::atomic<size_t> m_remaining {0};            //!< The predecessors to wait for.
+                    friend class Graph;
+                };
+                
+                //! @brief the constructor.
+                //! @param queue_id The id of the queue in wich the graph will be added.
+                Graph(const id_t queue_id = 0) : m_task(*this, queue_id) {}
+                
+                //! @brief Adds a node to the graph.
+                //! @details A node can only be owned by one graph, adding a node of another
+                //! graph is an error.
+                //! @param node The node to add.
+                void add(Node& node);
+                
+                //! @brief Creates a dependency between two nodes.
+                //! @details The nodes are added to the graph if needed, so they can't belong
+                //! to another graph. This method may allocate memory.
+                //! @param from The node that must be called first.
+                //! @param to The node that must be called after.
+                void link(Node& from, Node& to);
+                
+                //! @brief Calls the nodes in the order of their dependencies.
+                void callback() override;
+                
+                //! @brief Notifies all the nodes that the graph has been dropped.
+                void dropped() override;
+                
+            private:
+                Graph(Graph const&) = delete;
+                Graph& operator=(Graph const&) = delete;
+                
+                Task            m_task;                 //!< The task of the graph.
+                Node*           m_nodes = nullptr;      //!< The nodes of the graph.
                 friend class Scheduler;
             };
             
+            //! @brief The constructor.
+            Scheduler();
+            
+            //! @brief The destructor.
+            //! @details The parent of the scheduler and the parent of its children are
+            //! cleared.
+            ~Scheduler();
+            
             //! @brief Prepare the scheduler for a specific queue.
             //! @details If a queue has never been used, the first use of queue calls its
             //! allocator. If for some case, you want to avoid this allocation, for example in
@@ -123,12 +267,104 @@ namespace kiwi
             //! @param time The time point where the task should be inserted.
             void add(Task& task, time_point_t const time);
             
+            //! @brief Adds a task or moves it only if the time is earlier.
+            //! @details If the task is pending, the method moves it only if the time is
+            //! earlier than its current time, otherwise the method adds the task. The
+            //! condition is evaluated by the queue, so redundant calls are cheap and can be
+            //! used to throttle a task.
+            //! @param task The task to add.
+            //! @param time The time point where the task should be inserted.
+            void add_if_earlier(Task& task, time_point_t const time);
+            
+            //! @brief Adds a task or moves it only if the time is later.
+            //! @details If the task is pending, the method moves it only if the time is
+            //! later than its current time, otherwise the method adds the task. The
+            //! condition is evaluated by the queue, so redundant calls are cheap and can be
+            //! used to debounce a task.
+            //! @param task The task to add.
+            //! @param time The time point where the task should be inserted.
+            void add_if_later(Task& task, time_point_t const time);
+            
+            //! @brief Adds a task only if it isn't pending.
+            //! @details If the task is pending, the method does nothing, otherwise the
+            //! method adds the task.
+            //! @param task The task to add.
+            //! @param time The time point where the task should be inserted.
+            void add_if_not_pending(Task& task, time_point_t const time);
+            
+            //! @brief Adds a graph at a specified time.
+            //! @details The graph is added as a single task of its queue.
+            //! @param graph The graph to add.
+            //! @param time The time point where the graph should be inserted.
+            void add(Graph& graph, time_point_t const time);
+            
             //! @brief Removes a task.
             //! @details This method removes a task from its queue. 
             //! @param task The task to remove.
             void remove(Task& task);
             
+            //! @brief Removes a graph.
+            //! @param graph The graph to remove.
+            void remove(Graph& graph);
+            
+            //! @brief Sets the overload policy of a queue.
+            //! @details The method must be called by the consumer.
+            //! @param queue_id The id of the queue.
+            //! @param policy The policy.
+            void set_policy(id_t const queue_id, Policy const& policy);
+            
+            //! @brief Gets the number of tasks dropped by the policy of a queue.
+            //! @param queue_id The id of the queue.
+            size_t get_dropped(id_t const queue_id) const;
+            
+#ifdef KIWI_SCHEDULER_SHARED_QUEUE
+            //! @brief Attaches a shared queue.
+            //! @details The records of the shared queue will be drained and performed each
+            //! time the scheduler performs. The method must be called by the consumer.
+            //! @param queue The shared queue to attach.
+            void attach(SharedQueue& queue);
+            
+            //! @brief Detaches a shared queue.
+            //! @details The method must be called by the consumer.
+            //! @param queue The shared queue to detach.
+            void detach(SharedQueue& queue);
+#endif
+            
+            //! @brief Sets the parent scheduler.
+            //! @details The scheduler is added to its parent as a single task whose time is
+            //! the earliest time of the tasks of the scheduler. When the head of one of its
+            //! queues changes, the scheduler marks itself and the parent updates the time of
+            //! the task before performing, so the parent only performs the children that
+            //! have tasks to perform. The parent can't be the scheduler itself nor one of its
+            //! children. The method must be called by the consumer.
+            //! @param parent The parent scheduler.
+            void set_parent(Scheduler& parent);
+            
+            //! @brief Clears the parent scheduler.
+            //! @details The method must be called by the consumer. The producers can still
+            //! use the scheduler, but the former parent must outlive their current calls.
+            //! If the scheduler is cleared while its parent performs, it must not be
+            //! destroyed before the end of this call.
+            void clear_parent();
+            
+            //! @brief Gets the number of calls to the perform method.
+            //! @details The method must be called by the consumer.
+            size_t get_perform_count() const;
+            
+            //! @brief Gets the number of times the parent has updated the task.
+            //! @details The method must be called by the consumer.
+            size_t get_update_count() const;
+            
         private:
+            Scheduler(Scheduler const&) = delete;
+            Scheduler& operator=(Scheduler const&) = delete;
+            
+            //! @brief Marks the scheduler so its parent updates its time.
+            void notify();
+            
+            //! @brief Gets the earliest time point of the tasks.
+            //! @details The method must be called by the consumer.
+            time_point_t next();
             
             // ============================================================================ //
             //                                  SCHEDULER QUEUE                             //
@@ -155,22 +391,92 @@ namespace kiwi
                 //! is removed from the queue if it has already been added and not consumed.
                 //! @param task The task to add.
                 //! @param time The time point where the task should be inserted.
-                void add(Task& task, time_point_t const time);
+                //! @return true if the head of the queue may have changed.
+                bool add(Task& task, time_point_t const time) { return add(task, time, time, time); }
+                
+                //! @brief Adds a task or moves it inside a range.
+                //! @details If the task is pending, its time is clipped to the range, so the
+                //! queue does nothing if the time doesn't change, otherwise the task is
+                //! added at the specified time. If the main list is locked, the condition is
+                //! composed with the future operation of the task and evaluated later.
+                //! @param task The task to add.
+                //! @param time The time point where the task should be inserted.
+                //! @param min The minimum time of the task if it's pending.
+                //! @param max The maximum time of the task if it's pending.
+                //! @return true if the head of the queue may have changed.
+                bool add(Task& task, time_point_t const time, time_point_t const min, time_point_t const max);
                 
                 //! @brief Removes a task.
                 //! @details This method is also lock free but for lock reasons, the method
                 //! can't be used by the add method.
                 //! @param task The task to remove.
-                void remove(Task& task);
+                //! @return true if the head of the queue may have changed.
+                bool remove(Task& task);
+                
+                //! @brief Gets the earliest time point of the tasks.
+                //! @details If tasks are waiting in the future list, the queue must be
+                //! performed as soon as possible, so the method returns zero.
+                //! @return The time point or the maximum if the queue is empty.
+                time_point_t next();
+                
+                //! @brief Sets the overload policy.
+                //! @param policy The policy.
+                void set_policy(Policy const& policy);
+                
+                //! @brief Gets the number of tasks dropped by the policy.
+                size_t get_dropped() const;
                 
             private:
+                
+                //! @brief Applies the policy to the list of tasks to perform.
+                //! @details The method must be called inside the main lock. The tasks beyond
+                //! the maximum number are pushed back to the main list.
+                //! @param ready The list of tasks to perform.
+                //! @param dropped The list of dropped tasks.
+                //! @param time The time point.
+                //! @return The new list of tasks to perform.
+                Task* shed(Task* ready, Task*& dropped, time_point_t const time);
+                
                 Task*           m_main  = nullptr;  //!< The main sorted linked list of tasks.
                 Task*           m_futur = nullptr;  //!< The linked list of tasks that will be inserted.
                 std::mutex      m_main_mutex;       //!< The main list mutex.
                 std::mutex      m_futur_mutex;      //!< The futur list mutex.
+                Policy          m_policy;           //!< The overload policy.
+                std::atomic<size_t> m_dropped {0};  //!< The number of dropped tasks.
+            };
+            
+            // ============================================================================ //
+            //                                  SCHEDULER LINK                              //
+            // ============================================================================ //
+            //! @brief The task of a child scheduler in its parent.
+            class Link : public Timer
+            {
+            public:
+                Link(Scheduler& owner) : m_owner(owner), m_task(*this) {}
+                
+                //! @brief Performs the child scheduler.
+                void callback() override;
+                
+                Scheduler&      m_owner;    //!< The child scheduler.
+                Task            m_task;     //!< The task in the parent.
             };
             
             std::map<id_t, Queue> m_queues; //!< The list of queues.
+            time_point_t          m_time = 0;           //!< The current time point.
+            std::atomic<Scheduler*> m_parent {nullptr}; //!< The parent scheduler.
+            Link                  m_link;               //!< The task in the parent.
+            std::atomic<bool>     m_dirty {false};      //!< If the parent must update the task.
+            Scheduler*            m_dirty_next = nullptr;   //!< The next dirty child.
+            Scheduler*            m_dirties = nullptr;  //!< The list of dirty children.
+            std::mutex            m_dirties_mutex;      //!< The dirty children mutex.
+            Queue                 m_children;           //!< The tasks of the children.
+            Scheduler*            m_first_child = nullptr;  //!< The list of children.
+            Scheduler*            m_next_sibling = nullptr; //!< The next child of the parent.
+            size_t                m_perform_count = 0;  //!< The number of performs.
+            size_t                m_update_count = 0;   //!< The number of updates.
+#ifdef KIWI_SCHEDULER_SHARED_QUEUE
+            SharedQueue*          m_shared = nullptr; //!< The list of shared queues.
+#endif
         };
     }
 }
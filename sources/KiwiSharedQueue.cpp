@@ -0,0 +1,282 @@
+/*
+ ==============================================================================
+ 
+ This file is part of the KIWI library.
+ Copyright (c) 2016, CICM, ANR MUSICOLL, Eliott Paris, Pierre Guillot, Jean Millot.
+ 
+ Permission is granted to use this software under the terms of the GPL v2
+ (or any later version). Details can be found at: www.gnu.org/licenses
+ 
+ KIWI is distributed in the hope that it will be useful, but WITHOUT ANY
+ WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ 
+ ------------------------------------------------------------------------------
+ 
+ Contact : cicm.mshparisnord@gmail.com
+ 
+ ==============================================================================
+ */
+
+#include "KiwiSharedQueue.hpp"
+
+#ifdef KIWI_SCHEDULER_SHARED_QUEUE
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace kiwi
+{
+    namespace engine
+    {
+        // ================================================================================ //
+        //                              SHARED QUEUE HEADER                                 //
+        // ================================================================================ //
+        //! @brief The header of the segment, followed by the ring buffer.
+        //! @details The write and read indices are never wrapped, so the number of records
+        //! in the ring is always the difference between them. They are on different cache
+        //! lines to avoid the false sharing between the producer and the consumer.
+        struct Scheduler::SharedQueue::Header
+        {
+            static const uint32_t magic_number = 0x4b495749;
+            
+            std::atomic<uint32_t>               magic;      //!< Set once the header is ready.
+            uint32_t                            capacity;   //!< The number of records.
+            alignas(64) std::atomic<uint64_t>   write;      //!< Owned by the producer.
+            alignas(64) std::atomic<uint64_t>   read;       //!< Owned by the consumer.
+        };
+        
+        // The atomics are shared between processes, so they must not rely on a lock that
+        // would be local to one process.
+        static_assert((std::is_same<uint64_t, unsigned long>::value ?
+                       ATOMIC_LONG_LOCK_FREE : ATOMIC_LLONG_LOCK_FREE) == 2 &&
+                      (std::is_same<uint32_t, unsigned int>::value ?
+                       ATOMIC_INT_LOCK_FREE : ATOMIC_LONG_LOCK_FREE) == 2,
+                      "the shared queue requires address-free lock-free atomics");
+        
+        // ================================================================================ //
+        //                               SHARED QUEUE SLOT                                  //
+        // ================================================================================ //
+        //! @brief The task that holds a record on the consumer side.
+        class Scheduler::SharedQueue::Slot : public Timer
+        {
+        public:
+            Slot(SharedQueue& owner) : m_owner(owner), m_task(*this) {}
+            
+            void callback() override
+            {
+                m_owner.m_receiver.receive(m_record);
+                m_next_free     = m_owner.m_free;
+                m_owner.m_free  = this;
+            }
+            
+            SharedQueue&    m_owner;                //!< The owner of the slot.
+            Record          m_record;               //!< The copy of the record.
+            Task            m_task;                 //!< The task of the slot.
+            Slot*           m_next_free = nullptr;  //!< The next available slot.
+        };
+        
+        namespace
+        {
+            typedef Scheduler::SharedQueue::Record record_t;
+            
+            inline size_t segment_size(size_t const capacity, size_t const header)
+            {
+                return header + capacity * sizeof(record_t);
+            }
+            
+            inline record_t* segment_records(void* memory, size_t const header)
+            {
+                return reinterpret_cast<record_t*>(static_cast<char*>(memory) + header);
+            }
+            
+            inline std::system_error segment_error(char const* what)
+            {
+                return std::system_error(errno, std::generic_category(), what);
+            }
+        }
+        
+        // ================================================================================ //
+        //                                  SHARED QUEUE                                    //
+        // ================================================================================ //
+        
+        Scheduler::SharedQueue::SharedQueue(std::string const& name, Receiver& receiver, size_t capacity) :
+        m_name(name), m_receiver(receiver), m_memory(nullptr), m_size(0)
+        {
+            size_t size = 1;
+            while(size < capacity)
+            {
+                size <<= 1;
+            }
+            capacity    = size;
+            m_capacity  = capacity;
+            m_size      = segment_size(capacity, sizeof(Header));
+            
+            // The slots are allocated before the segment, so an allocation failure doesn't
+            // leave the segment mapped and linked.
+            m_slots.reserve(capacity);
+            for(size_t i = 0; i < capacity; ++i)
+            {
+                m_slots.emplace_back(new Slot(*this));
+                m_slots.back()->m_next_free = m_free;
+                m_free = m_slots.back().get();
+            }
+            
+            shm_unlink(m_name.c_str());
+            int const fd = shm_open(m_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+            if(fd < 0)
+            {
+                throw segment_error("shm_open");
+            }
+            if(ftruncate(fd, static_cast<off_t>(m_size)) != 0)
+            {
+                std::system_error error = segment_error("ftruncate");
+                close(fd);
+                shm_unlink(m_name.c_str());
+                throw error;
+            }
+            m_memory = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if(m_memory == MAP_FAILED)
+            {
+                std::system_error error = segment_error("mmap");
+                shm_unlink(m_name.c_str());
+                throw error;
+            }
+            
+            // The segment is zero-filled and the magic number is written last, so a
+            // producer that opens the segment too early refuses it.
+            Header* header = new (m_memory) Header();
+            header->capacity = static_cast<uint32_t>(capacity);
+            header->write.store(0, std::memory_order_relaxed);
+            header->read.store(0, std::memory_order_relaxed);
+            header->magic.store(Header::magic_number, std::memory_order_release);
+        }
+        
+        Scheduler::SharedQueue::~SharedQueue()
+        {
+            munmap(m_memory, m_size);
+            shm_unlink(m_name.c_str());
+        }
+        
+        void Scheduler::SharedQueue::perform(time_point_t const time)
+        {
+            // The other process can corrupt the segment, so the consumer only relies on its
+            // own capacity and read index, and checks the records.
+            Header* header = static_cast<Header*>(m_memory);
+            record_t* records = segment_records(m_memory, sizeof(Header));
+            uint64_t const mask = m_capacity - 1;
+            
+            // ------------------------------------------//
+            // Moves the records to available tasks      //
+            // ------------------------------------------//
+            uint64_t const write = header->write.load(std::memory_order_acquire);
+            uint64_t count = std::min(write - m_read, m_capacity);
+            while(count && m_free)
+            {
+                Slot* slot  = m_free;
+                slot->m_record = records[m_read & mask];
+                ++m_read;
+                --count;
+                if(slot->m_record.size > payload_size)
+                {
+                    ++m_rejected;
+                    continue;
+                }
+                m_free      = slot->m_next_free;
+                m_queue.add(slot->m_task, static_cast<time_point_t>(slot->m_record.time));
+            }
+            // Releases the records to the producer
+            header->read.store(m_read, std::memory_order_release);
+            
+            // ------------------------------------------//
+            // Performs the records                      //
+            // ------------------------------------------//
+            m_queue.perform(time);
+        }
+        
+        size_t Scheduler::SharedQueue::get_rejected() const
+        {
+            return m_rejected;
+        }
+        
+        // ================================================================================ //
+        //                              SHARED QUEUE PRODUCER                               //
+        // ================================================================================ //
+        
+        Scheduler::SharedQueue::Producer::Producer(std::string const& name) :
+        m_memory(nullptr), m_size(0)
+        {
+            int const fd = shm_open(name.c_str(), O_RDWR, 0600);
+            if(fd < 0)
+            {
+                throw segment_error("shm_open");
+            }
+            struct stat infos;
+            if(fstat(fd, &infos) != 0 || size_t(infos.st_size) < sizeof(Header))
+            {
+                std::system_error error = segment_error("fstat");
+                close(fd);
+                throw error;
+            }
+            m_size   = size_t(infos.st_size);
+            m_memory = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if(m_memory == MAP_FAILED)
+            {
+                throw segment_error("mmap");
+            }
+            
+            Header* header = static_cast<Header*>(m_memory);
+            if(header->magic.load(std::memory_order_acquire) != Header::magic_number ||
+               segment_size(header->capacity, sizeof(Header)) > m_size)
+            {
+                munmap(m_memory, m_size);
+                errno = EINVAL;
+                throw segment_error("segment not ready");
+            }
+        }
+        
+        Scheduler::SharedQueue::Producer::~Producer()
+        {
+            munmap(m_memory, m_size);
+        }
+        
+        bool Scheduler::SharedQueue::Producer::push(uint64_t time, uint32_t message, void const* data, size_t size)
+        {
+            Header* header = static_cast<Header*>(m_memory);
+            if(size > payload_size)
+            {
+                return false;
+            }
+            uint64_t const write = header->write.load(std::memory_order_relaxed);
+            if(write - header->read.load(std::memory_order_acquire) >= header->capacity)
+            {
+                return false;
+            }
+            
+            record_t& record = segment_records(m_memory, sizeof(Header))[write & (header->capacity - 1)];
+            record.time     = time;
+            record.message  = message;
+            record.size     = static_cast<uint32_t>(size);
+            if(size)
+            {
+                std::memcpy(record.payload, data, size);
+            }
+            // Publishes the record to the consumer
+            header->write.store(write + 1, std::memory_order_release);
+            return true;
+        }
+    }
+}
+
+#endif // KIWI_SCHEDULER_SHARED_QUEUE
+
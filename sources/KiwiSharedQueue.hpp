@@ -0,0 +1,163 @@
+/*
+ ==============================================================================
+ 
+ This file is part of the KIWI library.
+ Copyright (c) 2016, CICM, ANR MUSICOLL, Eliott Paris, Pierre Guillot, Jean Millot.
+ 
+ Permission is granted to use this software under the terms of the GPL v2
+ (or any later version). Details can be found at: www.gnu.org/licenses
+ 
+ KIWI is distributed in the hope that it will be useful, but WITHOUT ANY
+ WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ 
+ ------------------------------------------------------------------------------
+ 
+ Contact : cicm.mshparisnord@gmail.com
+ 
+ ==============================================================================
+ */
+
+#ifndef KIWI_ENGINE_SHARED_QUEUE_HPP_INCLUDED
+#define KIWI_ENGINE_SHARED_QUEUE_HPP_INCLUDED
+
+#include "KiwiScheduler.hpp"
+
+#ifdef KIWI_SCHEDULER_SHARED_QUEUE
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace kiwi
+{
+    namespace engine
+    {
+        // ================================================================================ //
+        //                                  SHARED QUEUE                                    //
+        // ================================================================================ //
+        //! @brief A queue of records fed by another process.
+        //! @details The shared queue owns a ring buffer in a POSIX shared-memory segment.
+        //! A producer in another process opens the segment by name and pushes records
+        //! without any system call, then the consumer drains the ring each time the
+        //! scheduler performs and calls the receiver for each record at its time point. As
+        //! the other queues, a segment accepts only one producer, so you need to use a
+        //! different shared queue for each producing process. The time points of the
+        //! records must be expressed in the time of the consumer.
+        class Scheduler::SharedQueue
+        {
+        public:
+            //! @brief The maximum size of the payload of a record.
+            static const size_t payload_size = 48;
+            
+            //! @brief The record exchanged between the processes.
+            struct Record
+            {
+                uint64_t    time;                   //!< The time point of the record.
+                uint32_t    message;                //!< The id of the message.
+                uint32_t    size;                   //!< The size of the payload.
+                char        payload[payload_size];  //!< The payload.
+            };
+            
+            // ============================================================================ //
+            //                                      RECEIVER                                //
+            // ============================================================================ //
+            //! @brief The receiver is the pure virtual class that consumes the records.
+            class Receiver
+            {
+            public:
+                //! @brief The destructor
+                virtual ~Receiver() {}
+                
+                //! @brief The callback method
+                //! @param record The record whose time point has been reached.
+                virtual void receive(Record const& record) = 0;
+            };
+            
+            // ============================================================================ //
+            //                                      PRODUCER                                //
+            // ============================================================================ //
+            //! @brief The producer side of a shared queue.
+            //! @details The producer opens the segment created by a shared queue, usually in
+            //! another process, and pushes records in the ring buffer.
+            class Producer
+            {
+            public:
+                //! @brief The constructor.
+                //! @details Throws a std::system_error if the segment can't be opened.
+                //! @param name The name of the segment.
+                Producer(std::string const& name);
+                
+                //! @brief The destructor.
+                ~Producer();
+                
+                //! @brief Pushes a record in the ring buffer.
+                //! @details This method is lock free and doesn't perform any system call.
+                //! @param time The time point of the record.
+                //! @param message The id of the message.
+                //! @param data The payload.
+                //! @param size The size of the payload.
+                //! @return false if the ring buffer is full or if the payload is too big.
+                bool push(uint64_t time, uint32_t message, void const* data = nullptr, size_t size = 0);
+            
+            private:
+                Producer(Producer const&) = delete;
+                Producer& operator=(Producer const&) = delete;
+                
+                void*           m_memory;   //!< The mapped segment.
+                size_t          m_size;     //!< The size of the mapped segment.
+            };
+            
+            //! @brief The constructor.
+            //! @details Creates the shared-memory segment, a previous segment with the same
+            //! name is replaced. Throws a std::system_error if the segment can't be created.
+            //! @param name The name of the segment, it should start with a slash.
+            //! @param receiver The receiver of the records.
+            //! @param capacity The number of records of the ring buffer, rounded up to the
+            //! next power of two.
+            SharedQueue(std::string const& name, Receiver& receiver, size_t capacity = 1024);
+            
+            //! @brief The destructor.
+            //! @details Unmaps and unlinks the segment. The queue must be detached from the
+            //! scheduler before.
+            ~SharedQueue();
+            
+            //! @brief Drains the ring buffer and performs the records until the time.
+            //! @details The records are moved from the ring buffer to a set of tasks
+            //! pre-allocated by the consumer. If all the tasks are pending, the next
+            //! records stay in the ring buffer until tasks are released.
+            //! @param time The time point.
+            void perform(time_point_t const time);
+            
+            //! @brief Gets the number of invalid records that have been skipped.
+            //! @details A record is invalid if its size is greater than the payload size.
+            size_t get_rejected() const;
+        
+        private:
+            SharedQueue(SharedQueue const&) = delete;
+            SharedQueue& operator=(SharedQueue const&) = delete;
+            
+            struct Header;
+            class Slot;
+            
+            std::string                         m_name;             //!< The name of the segment.
+            Receiver&                           m_receiver;         //!< The receiver.
+            void*                               m_memory;           //!< The mapped segment.
+            size_t                              m_size;             //!< The size of the mapped segment.
+            uint64_t                            m_capacity;         //!< The number of records.
+            uint64_t                            m_read = 0;         //!< The read index.
+            size_t                              m_rejected = 0;     //!< The invalid records.
+            std::vector<std::unique_ptr<Slot>>  m_slots;            //!< The pre-allocated tasks.
+            Slot*                               m_free = nullptr;   //!< The available tasks.
+            Queue                               m_queue;            //!< The pending tasks.
+            SharedQueue*                        m_next = nullptr;   //!< The next shared queue.
+            friend class Scheduler;
+        };
+    }
+}
+
+#endif // KIWI_SCHEDULER_SHARED_QUEUE
+
+#endif // KIWI_ENGINE_SHARED_QUEUE_HPP_INCLUDED
+
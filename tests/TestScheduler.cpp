@@ -21,9 +21,18 @@
  ==============================================================================
  */
 
+#include <algorithm>
 #include <iostream>
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <string>
 #include "TestScheduler.hpp"
+#ifdef KIWI_SCHEDULER_SHARED_QUEUE
+#include <KiwiSharedQueue.hpp>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 namespace kiwi
 {
@@ -209,6 +218,440 @@ namespace kiwi
             thread_high.join();
             Scheduler::perform(m_time.load()+size_t(time.count()));
         }
+        
+        // ================================================================================ //
+        //                                      COUNTER                                     //
+        // ================================================================================ //
+        class Counter : public Scheduler::Timer
+        {
+        public:
+            void callback() override { ++m_called; }
+            void dropped() override { ++m_dropped; }
+            size_t m_called  = 0;
+            size_t m_dropped = 0;
+        };
+        
+        void testPolicy()
+        {
+            Scheduler scheduler;
+            Counter counter;
+            Scheduler::Tag tag;
+            std::vector<std::unique_ptr<Scheduler::Task>> tasks;
+            for(size_t i = 0; i < 8; ++i)
+            {
+                tasks.emplace_back(new Scheduler::Task(counter, 0, &tag));
+            }
+            Scheduler::Policy policy;
+            
+            // The late tasks are dropped
+            policy.lateness = 5;
+            scheduler.set_policy(0, policy);
+            for(size_t i = 0; i < tasks.size(); ++i)
+            {
+                scheduler.add(*tasks[i], i);
+            }
+            scheduler.perform(10);
+            assert(counter.m_called == 3 && counter.m_dropped == 5 && "lateness failed");
+            assert(scheduler.get_dropped(0) == 5 && "wrong number of dropped tasks");
+            
+            // Only the most recent task of a tag is performed
+            policy = Scheduler::Policy();
+            policy.coalesce = true;
+            scheduler.set_policy(0, policy);
+            Scheduler::Task untagged(counter, 0);
+            scheduler.add(untagged, 0);
+            for(size_t i = 0; i < tasks.size(); ++i)
+            {
+                scheduler.add(*tasks[i], i);
+            }
+            scheduler.perform(10);
+            assert(counter.m_called == 5 && counter.m_dropped == 12 && "coalesce failed");
+            
+            // The tasks beyond the maximum are performed later
+            policy = Scheduler::Policy();
+            policy.max_tasks = 3;
+            scheduler.set_policy(0, policy);
+            for(size_t i = 0; i < tasks.size(); ++i)
+            {
+                scheduler.add(*tasks[i], i);
+            }
+            scheduler.perform(10);
+            assert(counter.m_called == 8 && "max tasks failed");
+            scheduler.perform(10);
+            assert(counter.m_called == 11 && "max tasks failed");
+            scheduler.perform(10);
+            assert(counter.m_called == 13 && counter.m_dropped == 12 && "max tasks failed");
+            assert(scheduler.get_dropped(0) == 12 && "wrong number of dropped tasks");
+            
+            // At least one task is performed per call
+            policy.max_tasks = 0;
+            scheduler.set_policy(0, policy);
+            scheduler.add(*tasks[0], 10);
+            scheduler.add(*tasks[1], 10);
+            scheduler.perform(10);
+            assert(counter.m_called == 14 && "max tasks of zero failed");
+            scheduler.perform(10);
+            assert(counter.m_called == 15 && counter.m_dropped == 12 && "max tasks of zero failed");
+        }
+        
+        void testConditional()
+        {
+            Scheduler scheduler;
+            Counter counter;
+            Scheduler::Task task(counter);
+            
+            // Throttle: the first request wins unless a request is earlier
+            scheduler.add_if_earlier(task, 10);
+            scheduler.add_if_earlier(task, 12);
+            scheduler.perform(9);
+            assert(counter.m_called == 0 && "add if earlier failed");
+            scheduler.add_if_earlier(task, 5);
+            scheduler.perform(5);
+            assert(counter.m_called == 1 && "add if earlier failed");
+            
+            // Debounce: the last request wins if it's later
+            scheduler.add_if_later(task, 10);
+            scheduler.add_if_later(task, 20);
+            scheduler.add_if_later(task, 15);
+            scheduler.perform(19);
+            assert(counter.m_called == 1 && "add if later failed");
+            scheduler.perform(20);
+            assert(counter.m_called == 2 && "add if later failed");
+            
+            // The task is added only once
+            scheduler.add_if_not_pending(task, 30);
+            scheduler.add_if_not_pending(task, 25);
+            scheduler.perform(29);
+            assert(counter.m_called == 2 && "add if not pending failed");
+            scheduler.perform(30);
+            assert(counter.m_called == 3 && "add if not pending failed");
+            
+            // A removed task is added again
+            scheduler.add(task, 40);
+            scheduler.remove(task);
+            scheduler.add_if_later(task, 35);
+            scheduler.perform(35);
+            assert(counter.m_called == 4 && "add after remove failed");
+            scheduler.perform(40);
+            assert(counter.m_called == 4 && "add after remove failed");
+        }
+        
+        void testConditionalConcurrency()
+        {
+            // The producer races the consumer, so part of the operations are composed in the
+            // future list. After each round, the time of the task must be the same as the
+            // sequential model. The fillers are due, so the consumer holds the main lock
+            // while it retrieves them.
+            Scheduler scheduler;
+            Counter counter, filler;
+            Scheduler::Task task(counter);
+            std::vector<std::unique_ptr<Scheduler::Task>> fillers;
+            for(size_t i = 0; i < 256; ++i)
+            {
+                fillers.emplace_back(new Scheduler::Task(filler));
+            }
+            
+            std::srand(42);
+            for(size_t round = 0; round < 500; ++round)
+            {
+                std::atomic<bool> done(false);
+                std::thread consumer([&scheduler, &done]()
+                                     {
+                                         while(!done)
+                                         {
+                                             scheduler.perform(0);
+                                         }
+                                     });
+                
+                bool pending = false;
+                size_t expected = 0;
+                for(size_t i = 0; i < 400; ++i)
+                {
+                    if(i % 100 == 0)
+                    {
+                        for(auto& other : fillers)
+                        {
+                            scheduler.add(*other, 0);
+                        }
+                    }
+                    size_t const time = 100 + size_t(std::rand() % 1000);
+                    switch(std::rand() % 5)
+                    {
+                        case 0:
+                            scheduler.add(task, time);
+                            expected = time;
+                            break;
+                        case 1:
+                            scheduler.add_if_earlier(task, time);
+                            expected = pending ? std::min(expected, time) : time;
+                            break;
+                        case 2:
+                            scheduler.add_if_later(task, time);
+                            expected = pending ? std::max(expected, time) : time;
+                            break;
+                        case 3:
+                            scheduler.add_if_not_pending(task, time);
+                            expected = pending ? expected : time;
+                            break;
+                        default:
+                            scheduler.remove(task);
+                            pending = false;
+                            continue;
+                    }
+                    pending = true;
+                }
+                scheduler.add_if_not_pending(task, 2000);
+                expected = pending ? expected : 2000;
+                done = true;
+                consumer.join();
+                
+                size_t const called = counter.m_called;
+                scheduler.perform(expected - 1);
+                assert(counter.m_called == called && "conditional operations performed too early");
+                scheduler.perform(expected);
+                assert(counter.m_called == called + 1 && "conditional operations composed wrongly");
+            }
+        }
+        
+        // ================================================================================ //
+        //                                      GRAPH                                       //
+        // ================================================================================ //
+        class Step : public Scheduler::Timer
+        {
+        public:
+            Step(std::vector<int>& order, int index) : m_order(order), m_index(index) {}
+            void callback() override { m_order.push_back(m_index); }
+        private:
+            std::vector<int>&   m_order;
+            int                 m_index;
+        };
+        
+        void testGraph()
+        {
+            Scheduler scheduler;
+            std::vector<int> order;
+            order.reserve(8);
+            Step a(order, 0), b(order, 1), c(order, 2), d(order, 3);
+            Scheduler::Graph::Node na(a), nb(b), nc(c), nd(d);
+            
+            // B runs after A and C, D runs after B
+            Scheduler::Graph graph;
+            graph.link(na, nb);
+            graph.link(nc, nb);
+            graph.link(nb, nd);
+            
+            for(size_t tick = 1; tick < 3; ++tick)
+            {
+                order.clear();
+                scheduler.add(graph, tick * 10);
+                scheduler.perform(tick * 10 - 1);
+                assert(order.empty() && "graph performed too early");
+                scheduler.perform(tick * 10);
+                assert(order.size() == 4 && "graph nodes not performed");
+                assert(order[2] == 1 && order[3] == 3 && "wrong graph order");
+            }
+            
+            // The nodes are notified when the graph is dropped
+            Counter c1, c2;
+            Scheduler::Graph::Node n1(c1), n2(c2);
+            Scheduler::Graph late;
+            late.link(n1, n2);
+            Scheduler::Policy policy;
+            policy.lateness = 0;
+            scheduler.set_policy(0, policy);
+            scheduler.add(late, 10);
+            scheduler.perform(20);
+            assert(c1.m_called == 0 && c2.m_called == 0 && "dropped graph performed");
+            assert(c1.m_dropped == 1 && c2.m_dropped == 1 && "dropped graph not forwarded");
+        }
+        
+        // ================================================================================ //
+        //                                      NESTED                                      //
+        // ================================================================================ //
+        void testNested()
+        {
+            Scheduler root, child, grandchild;
+            child.set_parent(root);
+            grandchild.set_parent(child);
+            
+            Counter counter;
+            Scheduler::Task task1(counter, 0), task2(counter, 1), task3(counter, 0);
+            child.add(task1, 10);
+            child.add(task2, 20);
+            grandchild.add(task3, 15);
+            
+            root.perform(5);
+            assert(counter.m_called == 0 && "nested task performed too early");
+            root.perform(10);
+            assert(counter.m_called == 1 && "nested task not performed");
+            root.perform(15);
+            assert(counter.m_called == 2 && "nested task not performed");
+            
+            // The time of the child follows its head
+            child.add(task2, 12);
+            root.perform(12);
+            assert(counter.m_called == 3 && "nested task not moved");
+            child.add(task1, 30);
+            child.remove(task1);
+            root.perform(30);
+            assert(counter.m_called == 3 && "nested task not removed");
+            
+            // A cleared child isn't performed anymore
+            grandchild.add(task3, 40);
+            grandchild.clear_parent();
+            root.perform(40);
+            assert(counter.m_called == 3 && "cleared task performed");
+            grandchild.perform(40);
+            assert(counter.m_called == 4 && "cleared task not performed");
+            child.clear_parent();
+        }
+        
+        void testNestedIdle()
+        {
+            Scheduler root, idle, busy;
+            idle.set_parent(root);
+            busy.set_parent(root);
+            
+            // The idle child is evaluated once when it's attached and never performed
+            Counter counter;
+            Scheduler::Task task(counter);
+            busy.add(task, 50);
+            for(size_t time = 0; time < 100; ++time)
+            {
+                root.perform(time);
+            }
+            assert(counter.m_called == 1 && "busy child not performed");
+            assert(idle.get_perform_count() == 0 && "idle child performed");
+            assert(idle.get_update_count() == 1 && "idle child evaluated");
+            assert(busy.get_perform_count() == 1 && "busy child performed without due task");
+            assert(busy.get_update_count() == 2 && "busy child evaluated without change");
+            
+            // The parent clears its children when it's destroyed
+            Scheduler orphan;
+            {
+                Scheduler parent;
+                orphan.set_parent(parent);
+            }
+            orphan.add(task, 10);
+            orphan.perform(10);
+            assert(counter.m_called == 2 && "orphan child not performed");
+        }
+        
+        class Detacher : public Scheduler::Timer
+        {
+        public:
+            Detacher(Scheduler& child) : m_child(child) {}
+            void callback() override { m_child.clear_parent(); }
+        private:
+            Scheduler& m_child;
+        };
+        
+        void testNestedDetach()
+        {
+            // A child cleared while its parent performs it in the same call
+            Scheduler root, a, b;
+            a.set_parent(root);
+            b.set_parent(root);
+            
+            Counter counter;
+            Detacher detacher(b);
+            Scheduler::Task task1(detacher), task2(counter);
+            a.add(task1, 9);
+            b.add(task2, 10);
+            root.perform(10);
+            assert(counter.m_called == 0 && "cleared child performed");
+            b.perform(10);
+            assert(counter.m_called == 1 && "cleared child task lost");
+            root.perform(20);
+            assert(counter.m_called == 1 && "cleared child performed");
+        }
+        
+#ifdef KIWI_SCHEDULER_SHARED_QUEUE
+        // ================================================================================ //
+        //                                  SHARED QUEUE                                    //
+        // ================================================================================ //
+        class Receiver : public Scheduler::SharedQueue::Receiver
+        {
+        public:
+            void receive(Scheduler::SharedQueue::Record const& record) override
+            {
+                assert(record.size == sizeof(uint32_t) && "wrong payload size");
+                uint32_t value;
+                std::memcpy(&value, record.payload, sizeof(value));
+                assert(value == record.message * 2 && "wrong payload");
+                assert(record.time <= m_time && "record performed too early");
+                m_sum += record.message;
+                ++m_count;
+            }
+            size_t m_time  = 0;
+            size_t m_count = 0;
+            size_t m_sum   = 0;
+        };
+        
+        void testSharedQueue()
+        {
+            // The pid avoids the collisions between concurrent runs
+            const std::string name = "/kiwi_scheduler_test_" + std::to_string(getpid());
+            const uint32_t size = 1000;
+            Scheduler scheduler;
+            Receiver receiver;
+            Scheduler::SharedQueue queue(name, receiver, 64);
+            scheduler.attach(queue);
+            
+            // The producer runs in another process and waits when the ring is full
+            pid_t pid = fork();
+            assert(pid >= 0 && "can't fork");
+            if(pid == 0)
+            {
+                try
+                {
+                    Scheduler::SharedQueue::Producer producer(name);
+                    for(uint32_t i = 0; i < size; ++i)
+                    {
+                        uint32_t value = i * 2;
+                        while(!producer.push(i % 16, i, &value, sizeof(value)))
+                        {
+                            std::this_thread::yield();
+                        }
+                    }
+                }
+                catch(...)
+                {
+                    _exit(1);
+                }
+                _exit(0);
+            }
+            
+            // Once the producer has exited, all the records are in the ring
+            int status = 0;
+            bool exited = false;
+            while(receiver.m_count < size)
+            {
+                if(!exited && waitpid(pid, &status, WNOHANG) == pid)
+                {
+                    exited = true;
+                    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                    {
+                        break;
+                    }
+                }
+                receiver.m_time = (receiver.m_time + 1) % 16;
+                scheduler.perform(receiver.m_time);
+            }
+            if(!exited)
+            {
+                waitpid(pid, &status, 0);
+            }
+            if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            {
+                std::cerr << "shared queue producer failed\n";
+                std::exit(1);
+            }
+            assert(queue.get_rejected() == 0 && "records rejected");
+            assert(receiver.m_sum == size_t(size) * (size - 1) / 2 && "records lost");
+            scheduler.detach(queue);
+        }
+#endif
     }
 }
 
@@ -217,6 +660,16 @@ namespace kiwi
 int main(int argc, char* const argv[])
 {
     std::cout << "running Unit-Tests - KiwiScheduler...";
+    kiwi::engine::testPolicy();
+    kiwi::engine::testConditional();
+    kiwi::engine::testConditionalConcurrency();
+    kiwi::engine::testGraph();
+    kiwi::engine::testNested();
+    kiwi::engine::testNestedDetach();
+    kiwi::engine::testNestedIdle();
+#ifdef KIWI_SCHEDULER_SHARED_QUEUE
+    kiwi::engine::testSharedQueue();
+#endif
     kiwi::engine::Instance instance;
     kiwi::engine::Instance::Ms t(1000);
     instance.run(t);